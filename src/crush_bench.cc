@@ -0,0 +1,535 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * crush_bench - offline CRUSH mapping throughput benchmark
+ *
+ * Copyright (c) 2015 by Acaleph Pty.
+ *
+ * Maps a range of inputs through every rule of a compiled CRUSH map (or of
+ * a synthetic host/osd hierarchy built with crush/builder.c), the same way
+ * CrushTester::test() does, but split across N threads and timed.  Reports
+ * mappings/s per rule, the cost of a single choose from each bucket grouped
+ * by CRUSH type (osd, host, root, ...) and by bucket algorithm, and
+ * optionally the choose_tries distribution.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/Clock.h"
+#include "common/Thread.h"
+#include "common/errno.h"
+#include "common/strtol.h"
+#include "crush/CrushWrapper.h"
+#include "include/buffer.h"
+#include "include/utime.h"
+#include "osd/osd_types.h"
+
+using namespace std;
+
+static void usage()
+{
+  cout << "usage: crush_bench [options]\n"
+       << "  -i <file>              compiled crush map (crushtool -c output);\n"
+       << "                         without it a synthetic map is built\n"
+       << "  --osds <n>             synthetic map: number of osds (default 1024)\n"
+       << "  --osds-per-host <n>    synthetic map: osds per host (default 16)\n"
+       << "  --bucket-alg <alg>     synthetic map: uniform, list, tree, straw\n"
+       << "                         or all (default all)\n"
+       << "  --rule <n>             only benchmark rule n (default all rules)\n"
+       << "  --num-rep <n>          replicas per mapping (default 3)\n"
+       << "  --min-x <n>            first input (default 0)\n"
+       << "  --max-x <n>            last input (default 1048575)\n"
+       << "  --threads <n>          mapping threads (default 1); each thread\n"
+       << "                         maps through its own decoded copy of the\n"
+       << "                         map, as crush_do_rule is not thread-safe\n"
+       << "  --use-wrapper          map through CrushWrapper::do_rule instead\n"
+       << "                         of crush_do_rule with per-thread scratch;\n"
+       << "                         do_rule serialises on the wrapper's\n"
+       << "                         mapper_lock, so this runs one thread\n"
+       << "  --show-choose-tries    print the choose_tries distribution\n"
+       << std::endl;
+}
+
+struct bench_opts_t {
+  int rule;
+  int num_rep;
+  int min_x;
+  int max_x;
+  int threads;
+  bool use_wrapper;
+  bool show_choose_tries;
+
+  bench_opts_t()
+    : rule(-1), num_rep(3), min_x(0), max_x(1024 * 1024 - 1),
+      threads(1), use_wrapper(false), show_choose_tries(false) {}
+};
+
+/*
+ * crush_do_rule is not thread-safe on a shared map: bucket_perm_choose
+ * caches its permutation (perm_x, perm_n, perm[]) in the bucket itself,
+ * which every uniform bucket and, with legacy tunables, every other bucket
+ * goes through.  Each thread therefore maps through a private copy of the
+ * map, decoded from the same encoding.
+ */
+class MapperThread : public Thread {
+  CrushWrapper crush;
+  const vector<__u32> &weight;
+  int rule, num_rep;
+  int64_t min_x, max_x;
+  bool use_wrapper;
+
+public:
+  uint64_t mapped;
+
+  MapperThread(bufferlist encoded, const vector<__u32> &w,
+	       int r, int n, int64_t minx, int64_t maxx, bool wrapper)
+    : weight(w), rule(r), num_rep(n), min_x(minx), max_x(maxx),
+      use_wrapper(wrapper), mapped(0) {
+    bufferlist::iterator p = encoded.begin();
+    crush.decode(p);
+  }
+
+  void *entry() {
+    if (use_wrapper) {
+      vector<int> out;
+      for (int64_t x = min_x; x <= max_x; ++x) {
+	crush.do_rule(rule, (int)x, out, num_rep, weight);
+	++mapped;
+      }
+    } else {
+      vector<int> result(num_rep);
+      vector<int> scratch(num_rep * 3);
+      for (int64_t x = min_x; x <= max_x; ++x) {
+	crush_do_rule(crush.crush, rule, (int)x, &result[0], num_rep,
+		      &weight[0], weight.size(), &scratch[0]);
+	++mapped;
+      }
+    }
+    return NULL;
+  }
+};
+
+/*
+ * Returns mappings/s; *nthreads is set to the number of threads actually
+ * used, which is less than --threads when the input range is smaller.
+ */
+static double bench_rule(const bufferlist &encoded, const vector<__u32> &weight,
+			 int rule, const bench_opts_t &opts, int *nthreads_out)
+{
+  int64_t total = (int64_t)opts.max_x - opts.min_x + 1;
+  int nthreads = opts.threads;
+  if (nthreads > total)
+    nthreads = total;
+  *nthreads_out = nthreads;
+
+  vector<MapperThread*> threads;
+  int64_t per = total / nthreads;
+  int64_t x = opts.min_x;
+  for (int i = 0; i < nthreads; ++i) {
+    int64_t last = (i == nthreads - 1) ? opts.max_x : x + per - 1;
+    threads.push_back(new MapperThread(encoded, weight, rule, opts.num_rep,
+				       x, last, opts.use_wrapper));
+    x = last + 1;
+  }
+
+  utime_t start = ceph_clock_now(NULL);
+  for (vector<MapperThread*>::iterator p = threads.begin(); p != threads.end(); ++p)
+    (*p)->create();
+  uint64_t mapped = 0;
+  for (vector<MapperThread*>::iterator p = threads.begin(); p != threads.end(); ++p) {
+    (*p)->join();
+    mapped += (*p)->mapped;
+    delete *p;
+  }
+  utime_t elapsed = ceph_clock_now(NULL) - start;
+
+  double secs = (double)elapsed;
+  return secs > 0 ? (double)mapped / secs : 0;
+}
+
+/*
+ * crush_do_rule bumps crush->choose_tries without any locking, so the
+ * profile is collected in a separate single-threaded pass.
+ */
+static void show_choose_tries(CrushWrapper &crush, const vector<__u32> &weight,
+			      int rule, const bench_opts_t &opts)
+{
+  if (crush.crush->choose_total_tries == 0) {
+    cerr << "  choose_total_tries is 0, no choose_tries profile" << std::endl;
+    return;
+  }
+
+  vector<int> result(opts.num_rep);
+  vector<int> scratch(opts.num_rep * 3);
+
+  crush.start_choose_profile();
+  for (int64_t x = opts.min_x; x <= opts.max_x; ++x)
+    crush_do_rule(crush.crush, rule, (int)x, &result[0], opts.num_rep,
+		  &weight[0], weight.size(), &scratch[0]);
+
+  __u32 *v = 0;
+  int n = crush.get_choose_profile(&v);
+
+  cout << "  choose_tries (tries: count)" << std::endl;
+  for (int i = 0; i < n; ++i) {
+    if (v[i] == 0)
+      continue;
+    char line[40];
+    snprintf(line, sizeof(line), "  %2d: %8u", i, v[i]);
+    cout << line << std::endl;
+  }
+  crush.stop_choose_profile();
+}
+
+static const char *rule_name(const CrushWrapper &crush, int rule)
+{
+  const char *name = crush.get_rule_name(rule);
+  return name ? name : "<unnamed>";
+}
+
+static const char *bucket_alg_name(int alg)
+{
+  switch (alg) {
+  case CRUSH_BUCKET_UNIFORM: return "uniform";
+  case CRUSH_BUCKET_LIST: return "list";
+  case CRUSH_BUCKET_TREE: return "tree";
+  case CRUSH_BUCKET_STRAW: return "straw";
+  default: return "unknown";
+  }
+}
+
+static const int max_bucket_alg = CRUSH_BUCKET_STRAW;
+
+struct bucket_cost_t {
+  int buckets;
+  uint64_t items;
+  uint64_t mapped;
+  double secs;
+
+  bucket_cost_t() : buckets(0), items(0), mapped(0), secs(0) {}
+
+  void add(int size, uint64_t n, double s) {
+    ++buckets;
+    items += size;
+    mapped += n;
+    secs += s;
+  }
+};
+
+static void print_bucket_cost(const string &label, const char *what,
+			      const char *name, const bucket_cost_t &c)
+{
+  char line[200];
+  snprintf(line, sizeof(line),
+	   "%s bucket %s %-10s buckets %5d avg size %6.1f: %.0f chooses/s"
+	   " (%.1f ns/choose)",
+	   label.c_str(), what, name, c.buckets, (double)c.items / c.buckets,
+	   c.secs > 0 ? (double)c.mapped / c.secs : 0,
+	   c.mapped ? c.secs * 1000000000.0 / c.mapped : 0);
+  cout << line << std::endl;
+}
+
+/*
+ * Time one choose out of each bucket, aggregated per CRUSH type (the
+ * bucket's place in the hierarchy: host, rack, root, ...) and per bucket
+ * algorithm (uniform, list, tree, straw).
+ *
+ * For every bucket a scratch rule "take <bucket>; choose firstn 1 type
+ * <type of its first item>; emit" is mapped over a sample of inputs, so
+ * each mapping performs a single bucket choose.  The take/emit overhead is
+ * the same for every bucket, so the numbers compare buckets with each other
+ * rather than giving an absolute per-choose cost.  Buckets whose items are
+ * of mixed types descend further and are counted as such.
+ *
+ * The scratch rule is added to the map, so this runs single-threaded after
+ * the rule benchmarks.
+ */
+static int bench_buckets(CrushWrapper &crush, const vector<__u32> &weight,
+			     const string &label, const bench_opts_t &opts)
+{
+  int ruleno = crush.add_rule(3, crush.get_max_rules(),
+			      pg_pool_t::TYPE_REPLICATED, 1, 1, -1);
+  if (ruleno < 0) {
+    cerr << label << ": unable to add scratch rule: " << cpp_strerror(ruleno)
+	 << std::endl;
+    return ruleno;
+  }
+  crush.set_rule_step_emit(ruleno, 2);
+
+  int64_t sample = (int64_t)opts.max_x - opts.min_x + 1;
+  if (sample > 16384)
+    sample = 16384;
+
+  map<int, bucket_cost_t> by_type;
+  map<int, bucket_cost_t> by_alg;
+  int result;
+  int scratch[3];
+
+  for (int i = 0; i < crush.crush->max_buckets; ++i) {
+    crush_bucket *b = crush.crush->buckets[i];
+    if (!b || b->size == 0 || b->alg < 1 || b->alg > max_bucket_alg)
+      continue;
+    int child_type = b->items[0] >= 0 ? 0 : crush.get_bucket_type(b->items[0]);
+    crush.set_rule_step_take(ruleno, 0, b->id);
+    crush.set_rule_step_choose_firstn(ruleno, 1, 1, child_type);
+
+    utime_t start = ceph_clock_now(NULL);
+    for (int64_t x = opts.min_x; x < opts.min_x + sample; ++x)
+      crush_do_rule(crush.crush, ruleno, (int)x, &result, 1,
+		    &weight[0], weight.size(), scratch);
+    double secs = (double)(ceph_clock_now(NULL) - start);
+
+    by_type[b->type].add(b->size, sample, secs);
+    by_alg[b->alg].add(b->size, sample, secs);
+  }
+
+  for (map<int, bucket_cost_t>::iterator p = by_type.begin(); p != by_type.end(); ++p) {
+    const char *name = crush.get_type_name(p->first);
+    char id[20];
+    if (!name) {
+      snprintf(id, sizeof(id), "type%d", p->first);
+      name = id;
+    }
+    print_bucket_cost(label, "type", name, p->second);
+  }
+  for (map<int, bucket_cost_t>::iterator p = by_alg.begin(); p != by_alg.end(); ++p)
+    print_bucket_cost(label, "alg ", bucket_alg_name(p->first), p->second);
+  return 0;
+}
+
+static int bench_map(CrushWrapper &crush, const string &label,
+		     const bench_opts_t &opts)
+{
+  if (crush.get_max_devices() <= 0) {
+    cerr << label << ": map has no devices" << std::endl;
+    return -EINVAL;
+  }
+  vector<__u32> weight(crush.get_max_devices(), 0x10000);
+  bufferlist encoded;
+  crush.encode(encoded);
+  int benched = 0;
+
+  for (int r = 0; r < crush.get_max_rules(); ++r) {
+    if (opts.rule >= 0 && r != opts.rule)
+      continue;
+    if (!crush.rule_exists(r))
+      continue;
+    if (opts.num_rep < crush.get_rule_mask_min_size(r) ||
+	opts.num_rep > crush.get_rule_mask_max_size(r)) {
+      cerr << label << " rule " << r << " (" << rule_name(crush, r)
+	   << ") does not accept num_rep " << opts.num_rep << ", skipping"
+	   << std::endl;
+      continue;
+    }
+
+    int nthreads;
+    double rate = bench_rule(encoded, weight, r, opts, &nthreads);
+    char line[200];
+    snprintf(line, sizeof(line),
+	     "%s rule %d (%s) x %d..%d num_rep %d threads %d: %.0f mappings/s",
+	     label.c_str(), r, rule_name(crush, r), opts.min_x, opts.max_x,
+	     opts.num_rep, nthreads, rate);
+    cout << line << std::endl;
+
+    if (opts.show_choose_tries)
+      show_choose_tries(crush, weight, r, opts);
+    ++benched;
+  }
+
+  if (!benched) {
+    cerr << label << ": no rule to benchmark" << std::endl;
+    return -ENOENT;
+  }
+  return bench_buckets(crush, weight, label, opts);
+}
+
+/*
+ * Two-level hierarchy: root -> hosts -> osds, every bucket using the
+ * same algorithm, with one replicated rule choosing leaves across hosts.
+ */
+static int build_synthetic_map(CrushWrapper &crush, int alg,
+			       int num_osds, int osds_per_host)
+{
+  /* uniform buckets require every item to carry the same weight */
+  if (alg == CRUSH_BUCKET_UNIFORM && num_osds % osds_per_host)
+    return -EINVAL;
+
+  crush.create();
+  crush.set_type_name(0, "osd");
+  crush.set_type_name(1, "host");
+  crush.set_type_name(2, "root");
+
+  vector<int> hosts;
+  vector<int> host_weights;
+  for (int osd = 0; osd < num_osds; osd += osds_per_host) {
+    vector<int> items;
+    vector<int> weights;
+    for (int i = osd; i < osd + osds_per_host && i < num_osds; ++i) {
+      items.push_back(i);
+      weights.push_back(0x10000);
+      char name[20];
+      snprintf(name, sizeof(name), "osd.%d", i);
+      crush.set_item_name(i, name);
+    }
+    int id;
+    int r = crush.add_bucket(0, alg, CRUSH_HASH_DEFAULT, 1, items.size(),
+			     &items[0], &weights[0], &id);
+    if (r < 0)
+      return r;
+    char name[20];
+    snprintf(name, sizeof(name), "host%d", (int)hosts.size());
+    crush.set_item_name(id, name);
+    hosts.push_back(id);
+    host_weights.push_back(0x10000 * items.size());
+  }
+
+  int root;
+  int r = crush.add_bucket(0, alg, CRUSH_HASH_DEFAULT, 2, hosts.size(),
+			   &hosts[0], &host_weights[0], &root);
+  if (r < 0)
+    return r;
+  crush.set_item_name(root, "default");
+
+  r = crush.add_simple_ruleset("replicated_ruleset", "default", "host",
+			       "firstn", pg_pool_t::TYPE_REPLICATED, &cerr);
+  if (r < 0)
+    return r;
+
+  crush.finalize();
+  return 0;
+}
+
+static bool parse_str_arg(int argc, const char **argv, int &i,
+			  const char *opt, string *val)
+{
+  if (strcmp(argv[i], opt) != 0)
+    return false;
+  if (i + 1 >= argc) {
+    cerr << "option " << opt << " requires an argument" << std::endl;
+    exit(1);
+  }
+  *val = argv[++i];
+  return true;
+}
+
+static bool parse_int_arg(int argc, const char **argv, int &i,
+			  const char *opt, int *val)
+{
+  string arg;
+  if (!parse_str_arg(argc, argv, i, opt, &arg))
+    return false;
+  string err;
+  *val = strict_strtol(arg.c_str(), 10, &err);
+  if (!err.empty()) {
+    cerr << "option " << opt << ": " << err << std::endl;
+    exit(1);
+  }
+  return true;
+}
+
+int main(int argc, const char **argv)
+{
+  bench_opts_t opts;
+  string infn;
+  string alg_name = "all";
+  int num_osds = 1024;
+  int osds_per_host = 16;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      usage();
+      return 0;
+    } else if (parse_str_arg(argc, argv, i, "-i", &infn) ||
+	       parse_str_arg(argc, argv, i, "--bucket-alg", &alg_name)) {
+      continue;
+    } else if (strcmp(argv[i], "--use-wrapper") == 0) {
+      opts.use_wrapper = true;
+    } else if (strcmp(argv[i], "--show-choose-tries") == 0) {
+      opts.show_choose_tries = true;
+    } else if (parse_int_arg(argc, argv, i, "--osds", &num_osds) ||
+	       parse_int_arg(argc, argv, i, "--osds-per-host", &osds_per_host) ||
+	       parse_int_arg(argc, argv, i, "--rule", &opts.rule) ||
+	       parse_int_arg(argc, argv, i, "--num-rep", &opts.num_rep) ||
+	       parse_int_arg(argc, argv, i, "--min-x", &opts.min_x) ||
+	       parse_int_arg(argc, argv, i, "--max-x", &opts.max_x) ||
+	       parse_int_arg(argc, argv, i, "--threads", &opts.threads)) {
+      continue;
+    } else {
+      cerr << "unrecognized argument '" << argv[i] << "'" << std::endl;
+      usage();
+      return 1;
+    }
+  }
+
+  if (opts.threads < 1 || opts.num_rep < 1 || opts.max_x < opts.min_x ||
+      num_osds < 1 || osds_per_host < 1) {
+    cerr << "invalid --threads, --num-rep, --min-x/--max-x, --osds or"
+	 << " --osds-per-host" << std::endl;
+    return 1;
+  }
+
+  if (opts.use_wrapper && opts.threads > 1) {
+    cerr << "--use-wrapper: CrushWrapper::do_rule serialises on mapper_lock,"
+	 << " running with 1 thread instead of " << opts.threads << std::endl;
+    opts.threads = 1;
+  }
+
+  if (!infn.empty()) {
+    bufferlist bl;
+    string error;
+    int r = bl.read_file(infn.c_str(), &error);
+    if (r < 0) {
+      cerr << "error reading '" << infn << "': " << error << std::endl;
+      return 1;
+    }
+    CrushWrapper crush;
+    try {
+      bufferlist::iterator p = bl.begin();
+      crush.decode(p);
+    } catch (buffer::error &e) {
+      cerr << "unable to decode " << infn << ": " << e.what() << std::endl;
+      return 1;
+    }
+    return bench_map(crush, infn, opts) < 0 ? 1 : 0;
+  }
+
+  struct {
+    const char *name;
+    int alg;
+  } algs[] = {
+    { "uniform", CRUSH_BUCKET_UNIFORM },
+    { "list", CRUSH_BUCKET_LIST },
+    { "tree", CRUSH_BUCKET_TREE },
+    { "straw", CRUSH_BUCKET_STRAW },
+  };
+
+  int benched = 0;
+  for (unsigned i = 0; i < sizeof(algs) / sizeof(algs[0]); ++i) {
+    if (alg_name != "all" && alg_name != algs[i].name)
+      continue;
+    CrushWrapper crush;
+    int r = build_synthetic_map(crush, algs[i].alg, num_osds, osds_per_host);
+    if (r < 0) {
+      cerr << "unable to build " << algs[i].name << " map: " << cpp_strerror(r)
+	   << std::endl;
+      return 1;
+    }
+    if (bench_map(crush, algs[i].name, opts) < 0)
+      return 1;
+    ++benched;
+  }
+  if (!benched) {
+    cerr << "unknown bucket algorithm '" << alg_name << "'" << std::endl;
+    return 1;
+  }
+  return 0;
+}